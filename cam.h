@@ -10,6 +10,7 @@ YUY2: 2592x1944@2fps; 2048x1536@3fps; 1920x1080@3fps; 1280x960@8fps; 1280x720@8f
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <linux/ioctl.h>
 #include <linux/types.h>
 #include <linux/v4l2-common.h>
@@ -240,49 +241,64 @@ int post_grab_frame(ImageGetter * g) {
     return 0;
 }
 
-int save_buffer(char *buffer, size_t buffer_size, const std::string& filename) {
-    std::ofstream ofs(filename, std::ios::binary);
-    if (!ofs) {
+// Size of one frame as negotiated with the driver, used to size a FrameArena
+size_t frame_buffer_size(ImageGetter * g)
+{
+	if (g->imageFormat.fmt.pix.sizeimage)
+		return g->imageFormat.fmt.pix.sizeimage;
+	return g->queryBuffer.length;
+}
+
+// Plain POSIX I/O so saving does not allocate a stream buffer per file
+int write_file(const char *data, size_t size, const std::string& filename) {
+    // 0666 like std::ofstream, the umask decides the final permissions
+    int fd;
+    do {
+        fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
         std::cerr << "Could not open file: " << filename << std::endl;
         return -1;
     }
 
-    if (!ofs.write(buffer, buffer_size)) {
-        std::cerr << "Could not write buffer to file: " << filename << std::endl;
-        return -1;
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0) {
+            std::cerr << "Could not write buffer to file: " << filename << std::endl;
+            close(fd);
+            return -1;
+        }
+        data += written;
+        size -= written;
     }
 
+    close(fd);
+    return 0;
+}
+
+int save_buffer(char *buffer, size_t buffer_size, const std::string& filename) {
+    if (write_file(buffer, buffer_size, filename) < 0)
+        return -1;
+
     std::cout << "Buffer saved to " << filename << std::endl;
 
     return 0;
 }
 int save_buffer_as_array(char *buffer, size_t buffer_size, const std::string& filename, int width, int height, int bytes_per_pixel) {
-    std::ofstream ofs(filename, std::ios::binary);
-    if (!ofs) {
-        std::cerr << "Could not open file: " << filename << std::endl;
+    // Calculate the number of bytes per row
+    size_t bytes_per_row = (size_t)width * bytes_per_pixel;
+    size_t image_size = bytes_per_row * height;
+    if (image_size > buffer_size) {
+        std::cerr << "Buffer too small for " << width << "x" << height << " image: " << filename << std::endl;
         return -1;
     }
 
-    // Calculate the number of bytes per row
-    int bytes_per_row = width * bytes_per_pixel;
-
-    // Create a 2D byte array of the appropriate size
-    std::vector<std::vector<unsigned char>> image_data(height, std::vector<unsigned char>(width));
-
-    // Copy the image data into the 2D array
-	cout << "Copying bytes..." << endl;
-    int buffer_index = 0;
-    for (int row = 0; row < height; row++) {
-        for (int col = 0; col < bytes_per_row; col++) {
-            image_data[row][col] = buffer[buffer_index++];
-        }
-    }
+    // Rows are contiguous in the capture buffer, write them out in one go
     cout << "Writing bytes into the file..." << endl;
-    // Write the 2D byte array to file
-	
-    for (int row = 0; row < height; row++) {
-        ofs.write(reinterpret_cast<char*>(image_data[row].data()), bytes_per_row);
-    }
+    if (write_file(buffer, image_size, filename) < 0)
+        return -1;
 
     std::cout << "Buffer saved to " << filename << std::endl;
 
@@ -0,0 +1,240 @@
+#ifndef FRAME_ARENA_HPP
+#define FRAME_ARENA_HPP
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <new>
+
+// Fixed pool of frame-sized slots for every copy that leaves the mmap'd V4L2
+// buffer. All memory is reserved, prefaulted and (optionally) locked up front,
+// so acquire()/release() never reach malloc and never page fault. See README.md
+// for checking the capture loop with the allocation counter.
+//
+//     FrameArena arena(frame_buffer_size(&g), 8);
+//     FrameArena::Slot slot = arena.acquire();
+//     ...
+//     arena.release(slot);
+
+#define FRAME_ARENA_NONE 0xFFFFFFFFu
+#define FRAME_ARENA_ALIGN 64
+#define FRAME_ARENA_HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+// Build with -DCAM_COUNT_ALLOCATIONS to count every global operator new call.
+// The replacement operators are not allowed to be inline, so exactly one
+// translation unit must also define CAM_ALLOCATION_COUNTER_IMPL before
+// including this header.
+inline std::atomic<uint64_t> cam_heap_allocation_count{0};
+
+inline constexpr bool cam_counting_allocations() {
+#ifdef CAM_COUNT_ALLOCATIONS
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Only meaningful when cam_counting_allocations() is true, stays at 0 otherwise
+inline uint64_t cam_heap_allocations() {
+    return cam_heap_allocation_count.load(std::memory_order_relaxed);
+}
+
+#if defined(CAM_COUNT_ALLOCATIONS) && defined(CAM_ALLOCATION_COUNTER_IMPL)
+void * operator new(size_t size) {
+    cam_heap_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void * p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void * operator new(size_t size, std::align_val_t align) {
+    cam_heap_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    size_t alignment = (size_t)align < sizeof(void *) ? sizeof(void *) : (size_t)align;
+    void * p = nullptr;
+    if (posix_memalign(&p, alignment, size ? size : 1) == 0)
+        return p;
+    throw std::bad_alloc();
+}
+void * operator new[](size_t size) { return operator new(size); }
+void * operator new[](size_t size, std::align_val_t align) { return operator new(size, align); }
+void operator delete(void * p) noexcept { free(p); }
+void operator delete[](void * p) noexcept { free(p); }
+void operator delete(void * p, size_t) noexcept { free(p); }
+void operator delete[](void * p, size_t) noexcept { free(p); }
+void operator delete(void * p, std::align_val_t) noexcept { free(p); }
+void operator delete[](void * p, std::align_val_t) noexcept { free(p); }
+void operator delete(void * p, size_t, std::align_val_t) noexcept { free(p); }
+void operator delete[](void * p, size_t, std::align_val_t) noexcept { free(p); }
+#endif
+
+class FrameArena
+{
+public:
+    struct Slot {
+        uint32_t index = FRAME_ARENA_NONE;
+        char * data = nullptr;
+        size_t size = 0;            // bytes in use, set by the caller
+    };
+    struct Stats {
+        uint64_t acquired = 0;
+        uint64_t released = 0;
+        uint64_t exhausted = 0;     // acquire() calls that found no free slot
+    };
+
+    FrameArena(size_t slot_size, uint32_t slots, bool huge_pages = true, bool lock = false);
+    ~FrameArena();
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    bool valid() const { return region != nullptr; }
+    bool huge_pages() const { return hugetlb; }
+    bool locked() const { return mlocked; }
+    size_t slot_size() const { return slot_bytes; }
+    uint32_t capacity() const { return slot_count; }
+
+    Slot acquire();
+    void release(Slot& slot);
+    Stats stats() const;
+    void print_stats() const;
+
+private:
+    static uint64_t pack(uint64_t tag, uint32_t index) { return (tag << 32) | index; }
+
+    char * region = nullptr;
+    size_t region_bytes = 0;
+    size_t slot_bytes = 0;
+    uint32_t slot_count = 0;
+    bool hugetlb = false;
+    bool mlocked = false;
+
+    // Treiber stack of free slot indices; the upper 32 bits of head are a
+    // generation tag so a slot recycled between load and CAS is not mistaken
+    // for the original head (ABA).
+    std::atomic<uint64_t> head{pack(0, FRAME_ARENA_NONE)};
+    std::unique_ptr<std::atomic<uint32_t>[]> next;
+
+    std::atomic<uint64_t> acquired{0};
+    std::atomic<uint64_t> released{0};
+    std::atomic<uint64_t> exhausted{0};
+};
+
+inline FrameArena::FrameArena(size_t slot_size, uint32_t slots, bool huge_pages, bool lock)
+{
+    if (slot_size == 0 || slots == 0 || slots == FRAME_ARENA_NONE) {
+        std::cerr << "FrameArena: invalid size " << slot_size << " x " << slots << std::endl;
+        return;
+    }
+    slot_bytes = (slot_size + FRAME_ARENA_ALIGN - 1) & ~(size_t)(FRAME_ARENA_ALIGN - 1);
+    slot_count = slots;
+    region_bytes = slot_bytes * slot_count;
+
+    void * mem = MAP_FAILED;
+    if (huge_pages) {
+        // Explicit huge pages first, they need a reserved pool (vm.nr_hugepages)
+        size_t huge_bytes = (region_bytes + FRAME_ARENA_HUGE_PAGE_SIZE - 1) & ~(FRAME_ARENA_HUGE_PAGE_SIZE - 1);
+        mem = mmap(NULL, huge_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            region_bytes = huge_bytes;
+            hugetlb = true;
+        }
+    }
+    if (mem == MAP_FAILED) {
+        mem = mmap(NULL, region_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            perror("FrameArena: could not map frame memory, mmap");
+            return;
+        }
+        // Fall back to transparent huge pages where the kernel allows it
+        if (huge_pages && madvise(mem, region_bytes, MADV_HUGEPAGE) < 0)
+            perror("FrameArena: transparent huge pages unavailable, madvise");
+    }
+    region = (char *)mem;
+
+    // Unprivileged callers usually hit RLIMIT_MEMLOCK here, check locked()
+    if (lock && mlock(region, region_bytes) == 0)
+        mlocked = true;
+    // Touch every page now so the capture loop never takes a page fault
+    memset(region, 0, region_bytes);
+
+    next.reset(new std::atomic<uint32_t>[slot_count]);
+    for (uint32_t i = 0; i < slot_count; i++)
+        next[i].store(i + 1 < slot_count ? i + 1 : FRAME_ARENA_NONE, std::memory_order_relaxed);
+    head.store(pack(0, 0), std::memory_order_release);
+
+    std::cout << "Frame arena: " << slot_count << " x " << slot_bytes << " bytes"
+              << (hugetlb ? ", hugetlb" : "") << (mlocked ? ", locked" : "") << std::endl;
+}
+
+inline FrameArena::~FrameArena()
+{
+    if (!region)
+        return;
+    if (mlocked)
+        munlock(region, region_bytes);
+    munmap(region, region_bytes);
+}
+
+inline FrameArena::Slot FrameArena::acquire()
+{
+    Slot slot;
+    if (!region)
+        return slot;
+
+    uint64_t old_head = head.load(std::memory_order_acquire);
+    while (true) {
+        uint32_t index = (uint32_t)old_head;
+        if (index == FRAME_ARENA_NONE) {
+            exhausted.fetch_add(1, std::memory_order_relaxed);
+            return slot;
+        }
+        uint32_t next_index = next[index].load(std::memory_order_relaxed);
+        if (head.compare_exchange_weak(old_head, pack((old_head >> 32) + 1, next_index),
+                                       std::memory_order_acq_rel, std::memory_order_acquire)) {
+            slot.index = index;
+            slot.data = region + (size_t)index * slot_bytes;
+            break;
+        }
+    }
+    acquired.fetch_add(1, std::memory_order_relaxed);
+    return slot;
+}
+
+inline void FrameArena::release(Slot& slot)
+{
+    if (slot.index == FRAME_ARENA_NONE || slot.index >= slot_count)
+        return;
+
+    uint64_t old_head = head.load(std::memory_order_relaxed);
+    do {
+        next[slot.index].store((uint32_t)old_head, std::memory_order_relaxed);
+    } while (!head.compare_exchange_weak(old_head, pack((old_head >> 32) + 1, slot.index),
+                                         std::memory_order_release, std::memory_order_relaxed));
+    released.fetch_add(1, std::memory_order_relaxed);
+    slot = Slot();
+}
+
+inline FrameArena::Stats FrameArena::stats() const
+{
+    Stats s;
+    s.acquired = acquired.load(std::memory_order_relaxed);
+    s.released = released.load(std::memory_order_relaxed);
+    s.exhausted = exhausted.load(std::memory_order_relaxed);
+    return s;
+}
+
+inline void FrameArena::print_stats() const
+{
+    Stats s = stats();
+    std::cout << "Frame arena: " << s.acquired << " acquired, "
+              << s.released << " released, "
+              << s.exhausted << " exhausted";
+    if (cam_counting_allocations())
+        std::cout << ", " << cam_heap_allocations() << " heap allocations";
+    std::cout << std::endl;
+}
+
+#endif
@@ -0,0 +1,344 @@
+#ifndef FRAME_SYNC_HPP
+#define FRAME_SYNC_HPP
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "cam.h"
+#include "frame_arena.hpp"
+
+// Groups frames coming from several ImageGetter streams into matched sets
+// using the driver timestamp (v4l2_buffer.timestamp, CLOCK_MONOTONIC).
+//
+// Payloads are copied into slots of a shared FrameArena and queues are fixed
+// rings, so nothing is allocated once the first set has been emitted. The arena
+// needs cameras * queue_depth slots for the queues plus cameras slots for each
+// set the caller holds at a time.
+//
+// Usage, with one FrameSet reused across iterations:
+//     FrameSync::FrameSet set;
+//     sync.push(cam_index, &g[cam_index]);  // after each grab_frame2()
+//     while (sync.pop(set)) { ...; sync.release(set); }
+
+class FrameSync
+{
+public:
+    struct Frame {
+        int camera = -1;
+        uint64_t timestamp_us = 0;  // driver timestamp, CLOCK_MONOTONIC
+        __u32 sequence = 0;         // driver frame counter
+        FrameArena::Slot slot;      // copy of the bytesused payload
+    };
+    struct FrameSet {
+        uint64_t timestamp_us = 0;  // timestamp of the reference camera (0)
+        std::vector<Frame> frames;  // indexed by camera
+    };
+    struct Stats {
+        uint64_t pushed = 0;
+        uint64_t matched = 0;       // sets emitted
+        uint64_t unmatched = 0;     // frames discarded because no partner was within tolerance
+        uint64_t dropped = 0;       // frames discarded because the camera's queue or the arena was full
+        uint64_t rejected = 0;      // frames without a monotonic timestamp or larger than an arena slot
+        uint64_t driver_dropped = 0; // frames the driver skipped, from gaps in sequence
+    };
+
+    FrameSync(FrameArena& arena, size_t cameras, uint64_t tolerance_us, size_t queue_depth = 4);
+    ~FrameSync();
+    // Queued frames own arena slots, so a FrameSync is neither copied nor moved
+    FrameSync(const FrameSync&) = delete;
+    FrameSync& operator=(const FrameSync&) = delete;
+
+    bool push(int camera, const ImageGetter * g);
+    bool push(Frame frame);
+    bool pop(FrameSet& set);
+    void release(FrameSet& set);
+
+    bool offset_us(int camera, double& offset);
+    uint64_t driver_dropped(int camera);
+    Stats stats();
+    void print_stats();
+
+    static uint64_t buffer_timestamp_us(const struct v4l2_buffer& buf);
+
+private:
+    struct Queue {
+        std::vector<Frame> frames;  // ring of queue_depth entries
+        size_t first = 0;
+        size_t count = 0;
+
+        bool empty() const { return count == 0; }
+        Frame& front() { return frames[first]; }
+        Frame& at(size_t i) { return frames[(first + i) % frames.size()]; }
+        void pop_front() { first = (first + 1) % frames.size(); count--; }
+        void push_back(const Frame& frame) { frames[(first + count) % frames.size()] = frame; count++; }
+    };
+
+    bool try_match(FrameSet& set);
+    void discard_front(Queue& queue);
+    static uint64_t distance(uint64_t a, uint64_t b) { return a > b ? a - b : b - a; }
+
+    std::mutex mutex;
+    FrameArena& arena;
+    uint64_t tolerance_us;
+    size_t queue_depth;
+    std::vector<Queue> queues;
+    std::vector<double> offsets;    // estimated offset of each camera vs camera 0, us (reported only)
+    std::vector<bool> offset_valid;
+    std::vector<__u32> last_sequence;
+    std::vector<bool> sequence_valid;
+    std::vector<uint64_t> camera_driver_dropped;
+    Stats counters;
+};
+
+// Weight of the newest sample in the running offset estimate
+#define FRAME_SYNC_OFFSET_ALPHA 0.1
+
+inline FrameSync::FrameSync(FrameArena& arena, size_t cameras, uint64_t tolerance_us, size_t queue_depth)
+    : arena(arena),
+      tolerance_us(tolerance_us),
+      queue_depth(queue_depth ? queue_depth : 1),
+      queues(cameras),
+      offsets(cameras, 0.0),
+      offset_valid(cameras, false),
+      last_sequence(cameras, 0),
+      sequence_valid(cameras, false),
+      camera_driver_dropped(cameras, 0)
+{
+    for (auto& queue : queues)
+        queue.frames.resize(this->queue_depth);
+}
+
+// Hands every queued slot back so the arena can serve a new FrameSync. Sets
+// already returned by pop() stay with the caller until release().
+inline FrameSync::~FrameSync()
+{
+    for (auto& queue : queues) {
+        while (!queue.empty())
+            discard_front(queue);
+    }
+}
+
+inline uint64_t FrameSync::buffer_timestamp_us(const struct v4l2_buffer& buf) {
+    return (uint64_t)buf.timestamp.tv_sec * 1000000ULL + (uint64_t)buf.timestamp.tv_usec;
+}
+
+inline bool FrameSync::push(int camera, const ImageGetter * g) {
+    if ((g->bufferinfo.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        std::cerr << "Camera " << camera << " does not report monotonic timestamps, frame rejected" << std::endl;
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.rejected++;
+        return false;
+    }
+    // Checked before anything is evicted, a frame that can never fit must not
+    // cost a queued one its place
+    if (g->bufferinfo.bytesused > arena.slot_size()) {
+        std::cerr << "Camera " << camera << ": frame of " << g->bufferinfo.bytesused
+                  << " bytes does not fit a " << arena.slot_size() << " byte arena slot, frame rejected" << std::endl;
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.rejected++;
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (camera < 0 || (size_t)camera >= queues.size()) {
+            std::cerr << "FrameSync: invalid camera index " << camera << std::endl;
+            return false;
+        }
+        // Make room before taking a slot, so a full queue hands its oldest
+        // frame's slot to the new one instead of dropping the new frame
+        Queue& queue = queues[camera];
+        if (queue.count >= queue_depth) {
+            discard_front(queue);
+            counters.dropped++;
+        }
+    }
+
+    Frame frame;
+    frame.camera = camera;
+    frame.timestamp_us = buffer_timestamp_us(g->bufferinfo);
+    frame.sequence = g->bufferinfo.sequence;
+    frame.slot = arena.acquire();
+    if (!frame.slot.data) {
+        std::cerr << "Camera " << camera << ": no free frame arena slot, frame dropped" << std::endl;
+        arena.release(frame.slot);
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.dropped++;
+        return false;
+    }
+    memcpy(frame.slot.data, g->buffer, g->bufferinfo.bytesused);
+    frame.slot.size = g->bufferinfo.bytesused;
+    return push(frame);
+}
+
+// Takes ownership of frame.slot, which goes back to the arena once the frame
+// is dropped, discarded or released as part of a set.
+inline bool FrameSync::push(Frame frame) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (frame.camera < 0 || (size_t)frame.camera >= queues.size()) {
+        std::cerr << "FrameSync: invalid camera index " << frame.camera << std::endl;
+        arena.release(frame.slot);
+        return false;
+    }
+
+    // The driver counts every frame it captured, a jump means it had no free
+    // buffer for the ones in between
+    if (sequence_valid[frame.camera]) {
+        __u32 gap = frame.sequence - last_sequence[frame.camera] - 1;
+        if (gap < 0x80000000u) {
+            camera_driver_dropped[frame.camera] += gap;
+            counters.driver_dropped += gap;
+        }
+        // else the counter went backwards, the stream was restarted
+    }
+    last_sequence[frame.camera] = frame.sequence;
+    sequence_valid[frame.camera] = true;
+
+    Queue& queue = queues[frame.camera];
+    if (queue.count >= queue_depth) {
+        // Keep the freshest frames, the oldest one can no longer be matched in time
+        discard_front(queue);
+        counters.dropped++;
+    }
+    queue.push_back(frame);
+    counters.pushed++;
+    return true;
+}
+
+inline void FrameSync::discard_front(Queue& queue) {
+    arena.release(queue.front().slot);
+    queue.pop_front();
+}
+
+inline void FrameSync::release(FrameSet& set) {
+    for (auto& frame : set.frames)
+        arena.release(frame.slot);
+    set.frames.clear();
+}
+
+inline bool FrameSync::pop(FrameSet& set) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return try_match(set);
+}
+
+inline bool FrameSync::try_match(FrameSet& set) {
+    if (queues.empty())
+        return false;
+
+    while (true) {
+        for (const auto& queue : queues) {
+            if (queue.empty())
+                return false;
+        }
+
+        // Every camera stamps on the same CLOCK_MONOTONIC, so heads are compared
+        // on raw timestamps; the tolerance bounds the real gap inside a set.
+        uint64_t anchor_ts = 0;
+        for (auto& queue : queues) {
+            if (queue.front().timestamp_us > anchor_ts)
+                anchor_ts = queue.front().timestamp_us;
+        }
+
+        // Move every camera to its frame closest to the newest head
+        bool advanced = false;
+        for (auto& queue : queues) {
+            while (queue.count > 1 && distance(queue.at(1).timestamp_us, anchor_ts) <= distance(queue.front().timestamp_us, anchor_ts)) {
+                discard_front(queue);
+                counters.unmatched++;
+                advanced = true;
+            }
+        }
+        if (advanced)
+            continue;
+
+        // A head older than the anchor is only known to be the closest once the
+        // camera's next frame has arrived
+        if (queue_depth > 1) {
+            for (auto& queue : queues) {
+                if (queue.count == 1 && queue.front().timestamp_us < anchor_ts)
+                    return false;
+            }
+        }
+
+        // The heads are now each camera's nearest frame to the anchor; learn the
+        // offsets from this pairing even when it ends up outside the tolerance
+        for (size_t i = 1; i < queues.size(); i++) {
+            double diff = (double)queues[i].front().timestamp_us - (double)queues[0].front().timestamp_us;
+            if (offset_valid[i]) {
+                offsets[i] += FRAME_SYNC_OFFSET_ALPHA * (diff - offsets[i]);
+            } else {
+                offsets[i] = diff;
+                offset_valid[i] = true;
+            }
+        }
+
+        size_t oldest = 0;
+        uint64_t oldest_ts = 0, newest_ts = 0;
+        for (size_t i = 0; i < queues.size(); i++) {
+            uint64_t ts = queues[i].front().timestamp_us;
+            if (i == 0 || ts < oldest_ts) { oldest = i; oldest_ts = ts; }
+            if (i == 0 || ts > newest_ts) newest_ts = ts;
+        }
+
+        if (newest_ts - oldest_ts > tolerance_us) {
+            // The oldest head has no partner close enough, nothing later can match it either
+            discard_front(queues[oldest]);
+            counters.unmatched++;
+            continue;
+        }
+
+        // A set still holding slots was not released, return them rather than leak
+        release(set);
+        set.frames.reserve(queues.size());
+        for (auto& queue : queues) {
+            set.frames.push_back(queue.front());
+            queue.pop_front();
+        }
+        set.timestamp_us = set.frames[0].timestamp_us;
+        counters.matched++;
+        return true;
+    }
+}
+
+// False until the camera has been paired with camera 0 at least once
+inline bool FrameSync::offset_us(int camera, double& offset) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (camera < 0 || (size_t)camera >= offsets.size() || !offset_valid[camera])
+        return false;
+    offset = offsets[camera];
+    return true;
+}
+
+inline uint64_t FrameSync::driver_dropped(int camera) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (camera < 0 || (size_t)camera >= camera_driver_dropped.size())
+        return 0;
+    return camera_driver_dropped[camera];
+}
+
+inline FrameSync::Stats FrameSync::stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+inline void FrameSync::print_stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    cout << "Frame sync: " << counters.pushed << " pushed, "
+         << counters.matched << " sets, "
+         << counters.unmatched << " unmatched, "
+         << counters.dropped << " dropped, "
+         << counters.rejected << " rejected, "
+         << counters.driver_dropped << " dropped by driver" << endl;
+    for (size_t i = 0; i < camera_driver_dropped.size(); i++) {
+        cout << "Camera " << i << " dropped by driver: " << camera_driver_dropped[i] << endl;
+    }
+    for (size_t i = 1; i < offsets.size(); i++) {
+        if (offset_valid[i])
+            cout << "Camera " << i << " offset: " << offsets[i] << " us" << endl;
+        else
+            cout << "Camera " << i << " offset: unknown" << endl;
+    }
+}
+
+#endif